@@ -2,54 +2,292 @@
  * hearts.cc
  * Source code for a program that plays Hearts using several strategies
  * Part of a bachelor thesis by Joris Teunisse, supervised by Walter Kosters
- * Compile using g++ -O2 -o hearts hearts.cc or the included run.sh file
+ * Compile using g++ -O2 -pthread -o hearts hearts.cc or the included run.sh file
  * Date of last edit: Jul 9, 2017
  */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
+// Random number generator with a state per thread, so that threads playing
+// games at the same time do not have to share the lock of rand()
+static thread_local unsigned long long randomState = 0x9E3779B97F4A7C15ULL;
+
+static void seedRandom(unsigned long long seed){
+  randomState = (seed + 1) * 0x9E3779B97F4A7C15ULL;
+  if(randomState == 0){
+    randomState = 1;
+  }
+}
+
+// Returns a random non-negative int (xorshift64*)
+static int randomInt(){
+  randomState ^= randomState >> 12;
+  randomState ^= randomState << 25;
+  randomState ^= randomState >> 27;
+  return (int)((randomState * 0x2545F4914F6CDD1DULL) >> 33);
+}
+
+// A decision of a Monte Carlo player as exported for training: what the
+// player knew, the cards it could choose from with their total playout
+// scores, and the card it chose
+struct TraceRecord{
+  unsigned long long hand;   // Cards in the hand of the player
+  unsigned long long played; // Cards played in earlier tricks
+  unsigned long long unseen; // Cards of which the player does not know the owner
+  int points[4];             // Points of every player during this round
+  int gamePoints[4];         // Points of every player during this game
+  int scores[13];            // Summed playout scores per candidate, lower is better
+  int playouts;              // Playouts per candidate
+  unsigned short voids;      // Bit 4*player+suit is set if the player lacks the suit
+  signed char player;
+  signed char first;         // Player that led the trick
+  signed char trickNr;
+  signed char table[3];      // Cards already played this trick, -1 if none
+  signed char amtValid;
+  signed char candidates[13];
+  signed char chosen;        // Index of the chosen card in candidates
+};
+
+// Writes trace records to a file through two buffers: the players fill one
+// while a background thread writes the other to disk
+class TraceWriter{
+  public:
+    TraceWriter(const char *fileName);
+    ~TraceWriter();
+    bool good(){return file.good();}
+    bool close();
+    long getAmount(){return amount;}
+    void write(const TraceRecord &record);
+  private:
+    static const size_t BUFFER_SIZE = 1 << 14;
+    void writeBuffers();
+    std::ofstream file;
+    std::vector<TraceRecord> buffers[2];
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread writer;
+    int filling;
+    bool full;
+    bool done;
+    bool closed;
+    long amount;
+};
+
+// Trace files start with this tag and the size of a record, followed by
+// the records
+static const char TRACE_TAG[4] = {'H', 'T', 'R', '1'};
+
+// Constructor: opens the file and starts the background thread
+TraceWriter::TraceWriter(const char *fileName) : file(fileName, std::ios::binary){
+  int recordSize = sizeof(TraceRecord);
+  file.write(TRACE_TAG, sizeof(TRACE_TAG));
+  file.write((const char*)&recordSize, sizeof(recordSize));
+  buffers[0].reserve(BUFFER_SIZE);
+  buffers[1].reserve(BUFFER_SIZE);
+  filling = 0;
+  full = false;
+  done = false;
+  closed = false;
+  amount = 0;
+  writer = std::thread(&TraceWriter::writeBuffers, this);
+}
+
+// Destructor: closes the file if that has not been done yet
+TraceWriter::~TraceWriter(){
+  close();
+}
+
+// Waits for the background thread, writes what is left and closes the
+// file, returning whether every record was written
+bool TraceWriter::close(){
+  if(!closed){
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      done = true;
+    }
+    changed.notify_all();
+    writer.join();
+    file.write((const char*)buffers[filling].data(), buffers[filling].size()*sizeof(TraceRecord));
+    file.close();
+    closed = true;
+  }
+  return !file.fail();
+}
+
+// Adds a record to the buffer being filled, and hands the buffer to the
+// background thread once it is full
+void TraceWriter::write(const TraceRecord &record){
+  std::unique_lock<std::mutex> guard(lock);
+  buffers[filling].push_back(record);
+  amount++;
+  if(buffers[filling].size() == BUFFER_SIZE){
+    changed.wait(guard, [this]{return !full;});
+    full = true;
+    filling ^= 1;
+    changed.notify_all();
+  }
+}
+
+// Background thread: writes every full buffer to disk
+void TraceWriter::writeBuffers(){
+  std::unique_lock<std::mutex> guard(lock);
+  while(true){
+    changed.wait(guard, [this]{return full || done;});
+    if(!full){
+      return;
+    }
+    std::vector<TraceRecord> &buffer = buffers[filling^1];
+    guard.unlock();
+    file.write((const char*)buffer.data(), buffer.size()*sizeof(TraceRecord));
+    guard.lock();
+    buffer.clear();
+    full = false;
+    changed.notify_all();
+  }
+}
+
+// Rule variants, passed to the engine as a template parameter so every
+// variant gets its own specialised code
+// StandardRules: hearts 1 point, queen of spades 13, shooting the moon
+// gives the other players 26 points, game ends at 100
+// Every variant has its own number, which is stored in the books built for it
+struct StandardRules{
+  static constexpr int variant = 0;
+  static constexpr int heartPoints = 1;
+  static constexpr int queenPoints = 13;
+  static constexpr int jackPoints = 0;
+  static constexpr int endPoints = 100;
+  static constexpr bool moonSubtracts = false;
+  static constexpr bool firstTrickScores = true;
+};
+
+// OmnibusRules: the jack of diamonds is worth -10 points
+struct OmnibusRules : StandardRules{
+  static constexpr int variant = 1;
+  static constexpr int jackPoints = -10;
+};
+
+// OldMoonRules: shooting the moon subtracts 26 points from the shooter
+struct OldMoonRules : StandardRules{
+  static constexpr int variant = 2;
+  static constexpr bool moonSubtracts = true;
+};
+
+// FreeFirstTrickRules: the first trick is worth no points, so penalty
+// cards may be played on it
+struct FreeFirstTrickRules : StandardRules{
+  static constexpr int variant = 3;
+  static constexpr bool firstTrickScores = false;
+};
+
+template<class Rules>
 class Hearts{
   public:
     Hearts();
     ~Hearts();
     enum P_Type{PT_RD, PT_MC, PT_CV, PT_HM, PT_RB};
+    // What a player has learned privately during the current round: the
+    // unseen cards are updated with every card that is passed or played,
+    // the suit owners when the player has to decide
+    struct Knowledge{
+      unsigned long long unseen; // Cards of which the owner is unknown
+      int owner[4];              // Player forced to own a suit, or -1
+    };
+    // A sampled deal of the cards a player has not seen, as the unseen
+    // cards every player holds in it
+    struct World{
+      unsigned long long cards[4];
+    };
+    // The worlds a player has sampled so far this round
+    struct Pool{
+      std::vector<World> worlds;
+      int amtOfWorlds;
+    };
+    // A decision stored in the opening book, for either passing or playing
+    struct BookEntry{
+      unsigned long long key;
+      signed char cards[3];
+    };
+    // The score of one choice in a situation while building the book:
+    // the summed playout score of a card, or minus one for a pass
+    struct BookVote{
+      unsigned long long key;
+      int choice;
+      long long score;
+    };
     struct Player{
       P_Type type;
-      bool known[52];
-      bool noneOfSuit[4];
+      Knowledge info;
+      unsigned long long cards;
       int hand[13];
       int validIndexes[13];
       int played;
       int points;
       int startPoints;
+      int penalties;
+      int taken;
       int place;
       int playouts;
       int threshold;
     };
     bool justInvalids(int pNr, bool queen);
+    bool equivalentCards(int pNr, int card1, int card2);
+    static int cardPoints(int card);
     int compareSituation(int pNr, Hearts O);
     int playRandomCard(int pNr);
     int playHumanCard(int pNr);
     int playCard(int pNr, int cardNr);
+    void placeCard(int pNr, int cardNr, int card);
+    void observeCard(int pNr, int card);
     int playMCCard(int pNr);
     int playRBCard(int pNr);
     int storeValidIndexes(int pNr);
     int getTotalPoints(int pNr){return totalPoints[pNr];}
+    long getDealNr(){return dealNr;}
+    long getAmtOfDeals(){return amtOfDeals;}
     void playTrick();
     void playRound();
     void playGame();
     void shuffle(int *deck, int maxSize);
+    void dealCards();
+    bool generateDeals(const char *fileName, int amount, unsigned int seed);
+    bool loadDeals(const char *fileName);
+    bool buildBook(const char *fileName, int amtOfGames, int playouts);
+    bool loadBook(const char *fileName);
+    bool lookupBook(int pNr, bool pass, int *cards);
+    void recordBook(int pNr, bool pass, const int *cards, const int *scores, int amount);
+    unsigned long long bookKey(int pNr, bool pass, bool &swapped);
+    void closeFiles();
+    void setDeal(long nr, int rot){dealNr = nr; rotation = rot;}
     void passCards();
+    void passMCCards(int pNr, int *passIndexes);
+    void exchangeCards(int passIndexes[4][3]);
     void printHand(int pNr);
     void evaluateTrick();
     void writeStats(std::ofstream &out);
     void setPT(int pNr, P_Type type){P[pNr].type = type;}
     void setPlayouts(int pNr, int amount){P[pNr].playouts = amount;}
     void setThreshold(int pNr, int amount){P[pNr].threshold = amount;}
+    void setPools(Pool *pools){this->pools = pools;}
+    void setTrace(TraceWriter *trace){this->trace = trace;}
+    void traceDecision(int pNr, int amtValid, const int *scores, int bestCardNr);
+    void refreshPool(int pNr);
+    bool repairWorld(int pNr, World &world);
+    void applyWorld(int pNr, const World &world);
     void setSuitOwners(int pNr);
     void debugMode(){debug = true;}
     void printCard(int card);
@@ -62,17 +300,92 @@ class Hearts{
     bool debug;
     bool gameWon;
     bool heartsBroken;
+    bool cardsPlayed[52];
     int deck[52];
+    int location[52];
+    int voids[4]; // Suits every player is known to lack
+    int held[4];  // Amount of cards every player holds
+    unsigned long long playedBy[4]; // Cards every player played in earlier tricks
     int totalPoints[4];
-    int ownerOfSuit[4];
     int first;
     int roundNr;
     int trickNr;
     int trump;
+    const unsigned char *deals;
+    size_t dealsSize;
+    long amtOfDeals;
+    long dealNr;
+    int rotation;
+    bool dealsReused;
+    const BookEntry *book;
+    size_t bookSize;
+    long amtOfEntries;
+    std::vector<BookVote> *recorded;
+    Pool *pools;
+    TraceWriter *trace;
 };
 
+// Deal files start with this tag and the amount of deals, followed by
+// 52 cards per deal of which every block of 13 is the hand of one player
+static const char DEAL_TAG[4] = {'H', 'D', 'L', '1'};
+static const int DEAL_HEADER = 8;
+
+// Book files start with this tag, the amount of entries, the rule variant
+// they were built for and 4 reserved bytes, which keeps the entries that
+// follow, sorted by key, aligned to 8 bytes
+// Decisions are stored for the pass and the first BOOK_TRICKS tricks
+static const char BOOK_TAG[4] = {'H', 'B', 'K', '2'};
+static const int BOOK_HEADER = 16;
+static const int BOOK_TRICKS = 2;
+
+// Maps a file starting with the given tag and an amount of records into
+// memory, returning NULL if it is missing or too short
+static const unsigned char *mapFile(const char *fileName, const char *tag,
+  size_t headerSize, size_t recordSize, size_t &size, long &amount){
+  struct stat info;
+  int records, fd = open(fileName, O_RDONLY);
+  void *data = MAP_FAILED;
+  if(fd != -1 && fstat(fd, &info) == 0 && (size_t)info.st_size >= headerSize){
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if(fd != -1){
+    close(fd);
+  }
+  if(data == MAP_FAILED){
+    std::cout << "Could not load " << fileName << std::endl;
+    return NULL;
+  }
+  memcpy(&records, (const char*)data + 4, sizeof(records));
+  if(memcmp(data, tag, 4) != 0 || records <= 0
+    || (size_t)info.st_size < headerSize + (size_t)records*recordSize){
+    std::cout << fileName << " is not a valid file of this type" << std::endl;
+    munmap(data, info.st_size);
+    return NULL;
+  }
+  size = info.st_size;
+  amount = records;
+  return (const unsigned char*)data;
+}
+
+// Mixes a value into a hash key
+static unsigned long long mixKey(unsigned long long key, unsigned long long value){
+  key ^= value + 0x9E3779B97F4A7C15ULL + (key << 6) + (key >> 2);
+  key ^= key >> 31;
+  key *= 0xBF58476D1CE4E5B9ULL;
+  return key ^ (key >> 29);
+}
+
+// Swaps clubs and diamonds in a card or a mask of cards
+static int swapSuits(int card){
+  return card < 13 ? card+13 : (card < 26 ? card-13 : card);
+}
+static unsigned long long swapSuits(unsigned long long mask){
+  return (mask & ~0x3FFFFFFULL) | ((mask & 0x1FFFULL) << 13) | ((mask >> 13) & 0x1FFFULL);
+}
+
 // Constructor
-Hearts::Hearts(){
+template<class Rules>
+Hearts<Rules>::Hearts(){
   for(int i = 0; i < 52; i++){
     deck[i] = i;
   }
@@ -80,16 +393,30 @@ Hearts::Hearts(){
     P[i].type = PT_RD;
   }
   debug = false;
+  deals = NULL;
+  dealsSize = 0;
+  amtOfDeals = 0;
+  book = NULL;
+  bookSize = 0;
+  amtOfEntries = 0;
+  recorded = NULL;
+  pools = NULL;
+  trace = NULL;
+  dealNr = 0;
+  rotation = 0;
+  dealsReused = false;
   memset(totalPoints, 0, sizeof(totalPoints));
 }
 
 // Destructor
-Hearts::~Hearts(){
+template<class Rules>
+Hearts<Rules>::~Hearts(){
 
 }
 
 // Prints a card integer in an easier format
-void Hearts::printCard(int card){
+template<class Rules>
+void Hearts<Rules>::printCard(int card){
   if(debug && card != -1){
     std::cout << "(" << card/13 << " " << card%13 << ") ";
   }
@@ -97,64 +424,331 @@ void Hearts::printCard(int card){
 
 // Shuffle a deck into a random order, while making sure
 // it does not go out of bounds
-void Hearts::shuffle(int *deck, int maxSize){
+template<class Rules>
+void Hearts<Rules>::shuffle(int *deck, int maxSize){
   int size = 0, r, temp;
   while(size < maxSize && deck[size] != -1){
     size++;
   }
   for(int i = size-1; i > 0; i--){
-    r = rand() % (i+1);
+    r = randomInt() % (i+1);
     temp = deck[r];
     deck[r] = deck[i];
     deck[i] = temp;
   }
 }
 
+// Deals the cards for a new round: either a random shuffle, or the next
+// deal from a loaded deal file with the hands rotated over the players
+// Once the file runs out its deals are reused, which is warned about once
+template<class Rules>
+void Hearts<Rules>::dealCards(){
+  if(deals != NULL){
+    if(dealNr >= amtOfDeals && !dealsReused){
+      std::cout << "Warning: all " << amtOfDeals << " deals have been used, reusing them" << std::endl;
+      dealsReused = true;
+    }
+    const unsigned char *deal = deals + DEAL_HEADER + (dealNr % amtOfDeals)*52;
+    for(int i = 0; i < 4; i++){
+      for(int j = 0; j < 13; j++){
+        deck[i*13+j] = deal[((i+rotation)%4)*13+j];
+      }
+    }
+    dealNr++;
+  }
+  else{
+    shuffle(deck, 52);
+  }
+}
+
+// Writes a file of seeded random deals, to be replayed using loadDeals
+template<class Rules>
+bool Hearts<Rules>::generateDeals(const char *fileName, int amount, unsigned int seed){
+  std::ofstream file(fileName, std::ios::binary);
+  unsigned char deal[52];
+  if(!file || amount <= 0){
+    std::cout << "Could not write " << amount << " deals to " << fileName << std::endl;
+    return false;
+  }
+  seedRandom(seed);
+  file.write(DEAL_TAG, sizeof(DEAL_TAG));
+  file.write((const char*)&amount, sizeof(amount));
+  for(int i = 0; i < amount; i++){
+    shuffle(deck, 52);
+    for(int j = 0; j < 52; j++){
+      deal[j] = deck[j];
+    }
+    file.write((const char*)deal, sizeof(deal));
+  }
+  return file.good();
+}
+
+// Maps a deal file into memory, after which every round takes the next
+// deal from it instead of shuffling. Every deal must be a permutation of
+// the 52 cards, or the file is rejected
+template<class Rules>
+bool Hearts<Rules>::loadDeals(const char *fileName){
+  if(deals != NULL){
+    munmap((void*)deals, dealsSize);
+  }
+  deals = mapFile(fileName, DEAL_TAG, DEAL_HEADER, 52, dealsSize, amtOfDeals);
+  for(long i = 0; deals != NULL && i < amtOfDeals; i++){
+    bool seen[52] = {false};
+    for(int j = 0; j < 52; j++){
+      int card = deals[DEAL_HEADER + i*52 + j];
+      if(card >= 52 || seen[card]){
+        std::cout << fileName << ": deal " << i << " is not a valid deal" << std::endl;
+        munmap((void*)deals, dealsSize);
+        deals = NULL;
+        break;
+      }
+      seen[card] = true;
+    }
+  }
+  return deals != NULL;
+}
+
+// Maps an opening book into memory, which MC players then consult for
+// passing and the first tricks
+template<class Rules>
+bool Hearts<Rules>::loadBook(const char *fileName){
+  if(book != NULL){
+    munmap((void*)((const unsigned char*)book - BOOK_HEADER), bookSize);
+  }
+  const unsigned char *data = mapFile(fileName, BOOK_TAG, BOOK_HEADER, sizeof(BookEntry), bookSize, amtOfEntries);
+  int variant;
+  book = NULL;
+  if(data == NULL){
+    return false;
+  }
+  memcpy(&variant, data + 8, sizeof(variant));
+  if(variant != Rules::variant){
+    std::cout << fileName << " was built for other rules" << std::endl;
+    munmap((void*)data, bookSize);
+    return false;
+  }
+  book = (const BookEntry*)(data + BOOK_HEADER);
+  return true;
+}
+
+// Unmaps the deal file and the book, if any
+// Only to be called on the original object, never on a copy
+template<class Rules>
+void Hearts<Rules>::closeFiles(){
+  if(deals != NULL){
+    munmap((void*)deals, dealsSize);
+    deals = NULL;
+  }
+  if(book != NULL){
+    munmap((void*)((const unsigned char*)book - BOOK_HEADER), bookSize);
+    book = NULL;
+  }
+}
+
+// Computes the key under which the situation of a player is stored in the
+// book: its hand, the cards it passed, the cards every player played in
+// earlier tricks and the voids of the others, both by relative seat, and
+// the cards on the table in order. Cards are described as masks, so the
+// order of the hand does not matter. After the first trick clubs and
+// diamonds are interchangeable unless the jack of diamonds scores, so they
+// are then swapped if that gives the smaller key.
+template<class Rules>
+unsigned long long Hearts<Rules>::bookKey(int pNr, bool pass, bool &swapped){
+  unsigned long long hand = P[pNr].cards, played = 0, table = 0, passed, keys[2];
+  int onTable[3], amtOnTable = 0;
+  for(int i = 0; i < 4; i++){
+    played |= playedBy[i];
+  }
+  for(int i = first; !pass && i%4 != pNr; i++){
+    onTable[amtOnTable] = P[i%4].played;
+    table |= 1ULL << onTable[amtOnTable];
+    amtOnTable++;
+  }
+  passed = ((1ULL << 52) - 1) & ~(P[pNr].info.unseen | hand | played | table);
+  for(int i = 0; i < 2; i++){
+    unsigned long long key = mixKey(pass, roundNr%4);
+    key = mixKey(key, i == 0 ? hand : swapSuits(hand));
+    key = mixKey(key, i == 0 ? passed : swapSuits(passed));
+    for(int j = 0; j < 4; j++){
+      int lacks = voids[(pNr+j)%4];
+      if(i == 1){
+        lacks = (lacks & ~3) | (lacks & 1) << 1 | (lacks & 2) >> 1;
+      }
+      key = mixKey(key, i == 0 ? playedBy[(pNr+j)%4] : swapSuits(playedBy[(pNr+j)%4]));
+      key = mixKey(key, lacks);
+    }
+    for(int j = 0; j < amtOnTable; j++){
+      key = mixKey(key, i == 0 ? onTable[j] : swapSuits(onTable[j]));
+    }
+    keys[i] = mixKey(key, amtOnTable);
+  }
+  swapped = !pass && trickNr > 0 && Rules::jackPoints == 0 && keys[1] < keys[0];
+  return keys[swapped];
+}
+
+// Looks up the decision of a player in the book, and stores the chosen
+// cards if it is found and they are in the hand of the player
+template<class Rules>
+bool Hearts<Rules>::lookupBook(int pNr, bool pass, int *cards){
+  bool swapped;
+  BookEntry target;
+  const BookEntry *entry;
+  if(book == NULL || P[pNr].type != PT_MC || (!pass && trickNr >= BOOK_TRICKS)){
+    return false;
+  }
+  target.key = bookKey(pNr, pass, swapped);
+  entry = std::lower_bound(book, book + amtOfEntries, target,
+    [](const BookEntry &a, const BookEntry &b){return a.key < b.key;});
+  if(entry == book + amtOfEntries || entry->key != target.key){
+    return false;
+  }
+  for(int i = 0; i < (pass ? 3 : 1); i++){
+    cards[i] = swapped ? swapSuits((int)entry->cards[i]) : entry->cards[i];
+    if(cards[i] < 0 || location[cards[i]] == -1 || location[cards[i]]/13 != pNr){
+      return false;
+    }
+  }
+  return true;
+}
+
+// Records the decision of a player while building the book: for a play
+// the scores of all candidate cards, for a pass a vote for the passed cards
+template<class Rules>
+void Hearts<Rules>::recordBook(int pNr, bool pass, const int *cards, const int *scores, int amount){
+  bool swapped;
+  BookVote vote;
+  if(recorded == NULL || (!pass && trickNr >= BOOK_TRICKS)){
+    return;
+  }
+  vote.key = bookKey(pNr, pass, swapped);
+  if(pass){
+    int sorted[3] = {cards[0], cards[1], cards[2]};
+    std::sort(sorted, sorted+3);
+    vote.choice = (sorted[0]*52 + sorted[1])*52 + sorted[2];
+    vote.score = -1;
+    recorded->push_back(vote);
+    return;
+  }
+  for(int i = 0; i < amount; i++){
+    vote.choice = swapped ? swapSuits(cards[i]) : cards[i];
+    vote.score = scores[i];
+    recorded->push_back(vote);
+  }
+}
+
+// Builds a book by letting four MC players with the given amount of
+// playouts play games, recording their passes and first tricks
+// If the same situation occurs more than once, the scores of all its
+// occurrences are added up before the best choice is taken
+template<class Rules>
+bool Hearts<Rules>::buildBook(const char *fileName, int amtOfGames, int playouts){
+  std::vector<BookVote> votes;
+  std::vector<BookEntry> entries;
+  std::ofstream file(fileName, std::ios::binary);
+  int amount = 0;
+  if(!file){
+    std::cout << "Could not write the book to " << fileName << std::endl;
+    return false;
+  }
+  for(int i = 0; i < 4; i++){
+    setPT(i, PT_MC);
+    setPlayouts(i, playouts);
+  }
+  recorded = &votes;
+  for(int i = 0; i < amtOfGames; i++){
+    playGame();
+  }
+  recorded = NULL;
+  std::sort(votes.begin(), votes.end(), [](const BookVote &a, const BookVote &b){
+    return a.key < b.key || (a.key == b.key && a.choice < b.choice);});
+  for(size_t i = 0; i < votes.size();){
+    BookEntry entry;
+    unsigned long long key = votes[i].key;
+    long long bestScore = 0;
+    int bestChoice = -1;
+    while(i < votes.size() && votes[i].key == key){
+      int choice = votes[i].choice;
+      long long score = 0;
+      for(; i < votes.size() && votes[i].key == key && votes[i].choice == choice; i++){
+        score += votes[i].score;
+      }
+      if(bestChoice == -1 || score < bestScore){
+        bestChoice = choice;
+        bestScore = score;
+      }
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.key = key;
+    if(bestChoice >= 52){
+      entry.cards[0] = bestChoice/2704;
+      entry.cards[1] = bestChoice/52%52;
+      entry.cards[2] = bestChoice%52;
+    }
+    else{
+      entry.cards[0] = bestChoice;
+      entry.cards[1] = entry.cards[2] = -1;
+    }
+    entries.push_back(entry);
+  }
+  amount = entries.size();
+  file.write(BOOK_TAG, sizeof(BOOK_TAG));
+  file.write((const char*)&amount, sizeof(amount));
+  int header[2] = {Rules::variant, 0};
+  file.write((const char*)header, sizeof(header));
+  file.write((const char*)entries.data(), amount*sizeof(BookEntry));
+  std::cout << "Wrote " << amount << " book entries to " << fileName << std::endl;
+  return file.good();
+}
+
 // Every player passes and receives 3 cards
-// TODO: RB/MC passing
-void Hearts::passCards(){
-  int passedCards[4][3];
+// MC players take their pass from the book if it is there
+// TODO: RB passing
+template<class Rules>
+void Hearts<Rules>::passCards(){
+  int passIndexes[4][3];
   bool human = false;
   if(roundNr%4 != 0){
     for(int i = 0; i < 4; i++){
+      int cards[3];
       if(P[i].type == PT_HM){
         human = true;
         printHand(i);
         std::cout << "Please enter three cards to pass to player ";
         std::cout  << (i+roundNr)%4 << " [0-12]" << std::endl;
-      }
-      for(int j = 0; j < 3; j++){
-        int toPass;
-        if(P[i].type == PT_HM){
-          std::cin >> toPass;
+        for(int j = 0; j < 3; j++){
+          std::cin >> passIndexes[i][j];
           std::cout << "You pass ";
-          printCard(P[i].hand[toPass]);
+          printCard(P[i].hand[passIndexes[i][j]]);
           std::cout << std::endl;
         }
-        else{
-          toPass = rand() % 13;
-          while(P[i].hand[toPass] == -1){
-            toPass = rand() % 13;
-          }
+      }
+      else if(lookupBook(i, true, cards)){
+        for(int j = 0; j < 3; j++){
+          passIndexes[i][j] = location[cards[j]]%13;
         }
-        if(P[i].type == PT_MC){
-          P[i].known[P[i].hand[toPass]] = true;
+      }
+      else if(recorded != NULL){
+        passMCCards(i, passIndexes[i]);
+        for(int j = 0; j < 3; j++){
+          cards[j] = P[i].hand[passIndexes[i][j]];
         }
-        passedCards[i][j] = P[i].hand[toPass];
-        P[i].hand[toPass] = -1;
+        recordBook(i, true, cards, NULL, 3);
       }
-    }
-    for(int i = 0; i < 4; i++){
-      int amtReceived = 0;
-      for(int j = 0; j < 13; j++){
-        if(P[i].hand[j] == -1){
-          P[i].hand[j] = passedCards[(i+roundNr)%4][amtReceived];
-          amtReceived++;
-          if(P[i].hand[j] == 0){
-            first = i;
+      else{
+        for(int j = 0; j < 3; j++){
+          bool taken = true;
+          while(taken){
+            passIndexes[i][j] = randomInt() % 13;
+            taken = false;
+            for(int k = 0; k < j; k++){
+              taken = taken || passIndexes[i][k] == passIndexes[i][j];
+            }
           }
         }
       }
+    }
+    exchangeCards(passIndexes);
+    for(int i = 0; i < 4; i++){
       if(!human){
         printHand(i);
       }
@@ -162,8 +756,98 @@ void Hearts::passCards(){
   }
 }
 
+// Removes the cards at the given indexes from every hand and hands them
+// to the player they are passed to
+template<class Rules>
+void Hearts<Rules>::exchangeCards(int passIndexes[4][3]){
+  int passedCards[4][3];
+  for(int i = 0; i < 4; i++){
+    for(int j = 0; j < 3; j++){
+      int cardNr = passIndexes[i][j];
+      passedCards[i][j] = P[i].hand[cardNr];
+      P[i].cards &= ~(1ULL << P[i].hand[cardNr]);
+      P[i].hand[cardNr] = -1;
+    }
+  }
+  for(int i = 0; i < 4; i++){
+    int amtReceived = 0;
+    for(int j = 0; j < 13; j++){
+      if(P[i].hand[j] == -1){
+        placeCard(i, j, passedCards[(i+roundNr)%4][amtReceived]);
+        P[i].info.unseen &= ~(1ULL << P[i].hand[j]);
+        amtReceived++;
+        if(P[i].hand[j] == 0){
+          first = i;
+        }
+      }
+    }
+  }
+}
+
+// Chooses the cards to pass for a player according to the Monte Carlo
+// strategy: the cards are picked one by one, each time taking the card
+// for which random playouts of the whole round give the fewest points,
+// with the cards still to be chosen passed at random
+template<class Rules>
+void Hearts<Rules>::passMCCards(int pNr, int *passIndexes){
+  for(int i = 0; i < 3; i++){
+    int lowestScore = 26*P[pNr].playouts+1;
+    for(int cardNr = 0; cardNr < 13; cardNr++){
+      int score = 0;
+      bool taken = false;
+      for(int j = 0; j < i; j++){
+        taken = taken || passIndexes[j] == cardNr;
+      }
+      if(taken){
+        continue;
+      }
+      for(int j = 0; j < P[pNr].playouts; j++){
+        Hearts T = *this;
+        int toPass[4][3];
+        T.debug = false;
+        T.recorded = NULL;
+        for(int k = 0; k < 4; k++){
+          T.P[k].type = PT_RD;
+        }
+        T.determinize(pNr);
+        for(int k = 0; k < 4; k++){
+          int from = 0;
+          if(k == pNr){
+            for(int l = 0; l < i; l++){
+              toPass[k][l] = passIndexes[l];
+            }
+            toPass[k][i] = cardNr;
+            from = i+1;
+          }
+          for(int l = from; l < 3; l++){
+            bool used = true;
+            while(used){
+              toPass[k][l] = randomInt() % 13;
+              used = false;
+              for(int m = 0; m < l; m++){
+                used = used || toPass[k][m] == toPass[k][l];
+              }
+            }
+          }
+        }
+        T.exchangeCards(toPass);
+        T.first = T.location[0]/13;
+        for(T.trickNr = 0; T.trickNr < 13; T.trickNr++){
+          T.playTrick();
+        }
+        score += T.compareSituation(pNr, *this);
+      }
+      if(score < lowestScore || (score == lowestScore && randomInt()%2 == 0)){
+        passIndexes[i] = cardNr;
+        lowestScore = score;
+      }
+    }
+  }
+}
+
 // Prints the hand of a player
-void Hearts::printHand(int pNr){
+template<class Rules>
+void Hearts<Rules>::printHand(int pNr){
   if(debug) std::cout << "Hand of player " << pNr << ":" << std::endl;
   for(int i = 0; i < 13; i++){
     printCard(P[pNr].hand[i]);
@@ -173,18 +857,18 @@ void Hearts::printHand(int pNr){
 
 // Checks whether a player is forced to play a normally invalid card:
 // either this consists of only Hearts, or Hearts and the Queen of Spades
-bool Hearts::justInvalids(int pNr, bool queen){
-  for(int i = 0; i < 13; i++){
-    int card = P[pNr].hand[i];
-    if(card != -1 && (card/13 != 2 || (queen && card != 49))){
-      return false;
-    }
+template<class Rules>
+bool Hearts<Rules>::justInvalids(int pNr, bool queen){
+  unsigned long long invalids = 0x1FFFULL << 26;
+  if(queen){
+    invalids |= 1ULL << 49;
   }
-  return true;
+  return (P[pNr].cards & ~invalids) == 0;
 }
 
 // Stores which card indexes are valid for a player, and returns the amount
-int Hearts::storeValidIndexes(int pNr){
+template<class Rules>
+int Hearts<Rules>::storeValidIndexes(int pNr){
   int amtValid = 0;
   if(trump == -1){
     if(trickNr == 0){
@@ -205,21 +889,21 @@ int Hearts::storeValidIndexes(int pNr){
       }
     }
   }
-  else{
+  else if(P[pNr].cards & (0x1FFFULL << 13*trump)){
     for(int i = 0; i < 13; i++){
       if(P[pNr].hand[i] != -1 && P[pNr].hand[i]/13 == trump){
         P[pNr].validIndexes[amtValid] = i;
         amtValid++;
       }
     }
-    if(amtValid == 0){
-      P[pNr].noneOfSuit[trump] = true;
-      for(int i = 0; i < 13; i++){
-        int card = P[pNr].hand[i];
-        if(card != -1 && (!(trickNr == 0 && (card/13 == 2 || card == 49)) || justInvalids(pNr, true))){
-          P[pNr].validIndexes[amtValid] = i;
-          amtValid++;
-        }
+  }
+  else{
+    for(int i = 0; i < 13; i++){
+      int card = P[pNr].hand[i];
+      if(card != -1 && (!(Rules::firstTrickScores && trickNr == 0 && (card/13 == 2 || card == 49))
+        || justInvalids(pNr, true))){
+        P[pNr].validIndexes[amtValid] = i;
+        amtValid++;
       }
     }
   }
@@ -227,13 +911,15 @@ int Hearts::storeValidIndexes(int pNr){
 }
 
 // Returns a random valid card belonging to the player in question
-int Hearts::playRandomCard(int pNr){
-  return playCard(pNr, P[pNr].validIndexes[rand() % storeValidIndexes(pNr)]);
+template<class Rules>
+int Hearts<Rules>::playRandomCard(int pNr){
+  return playCard(pNr, P[pNr].validIndexes[randomInt() % storeValidIndexes(pNr)]);
 }
 
 // Lets a human choose a card to play for to the player in question
 // TODO: Reject wrong input (spare time)
-int Hearts::playHumanCard(int pNr){
+template<class Rules>
+int Hearts<Rules>::playHumanCard(int pNr){
   int amtValid = storeValidIndexes(pNr), cardNr;
   std::cout << std::endl;
   printHand(pNr);
@@ -248,22 +934,49 @@ int Hearts::playHumanCard(int pNr){
 }
 
 // Plays a specific card for a player
-int Hearts::playCard(int pNr, int cardNr){
+template<class Rules>
+int Hearts<Rules>::playCard(int pNr, int cardNr){
   int card = P[pNr].hand[cardNr];
   P[pNr].hand[cardNr] = -1;
+  P[pNr].cards &= ~(1ULL << card);
+  location[card] = -1;
   if(trump == -1){
     trump = card/13;
   }
+  observeCard(pNr, card);
   return card;
 }
 
+// Puts a card in a specific spot of the hand of a player
+template<class Rules>
+void Hearts<Rules>::placeCard(int pNr, int cardNr, int card){
+  P[pNr].hand[cardNr] = card;
+  P[pNr].cards |= 1ULL << card;
+  location[card] = pNr*13+cardNr;
+}
+
+// Takes note of a card that was just played: it is no longer unseen to
+// any player, and if it does not follow the trump the player who played
+// it has run out of that suit
+template<class Rules>
+void Hearts<Rules>::observeCard(int pNr, int card){
+  for(int i = 0; i < 4; i++){
+    P[i].info.unseen &= ~(1ULL << card);
+  }
+  held[pNr]--;
+  if(card/13 != trump){
+    voids[pNr] |= 1 << trump;
+  }
+}
+
 // Plays a card according to a few simple rules
 // Always leads with the lowest card available
 // If not leading, try to get rid of the penalty cards or play
 // the highest card that can be freely discarded
 // Also aims to shoot the moon if the player is the only one with
 // penalty points, given the points are above a certain threshold
-int Hearts::playRBCard(int pNr){
+template<class Rules>
+int Hearts<Rules>::playRBCard(int pNr){
   int amtValid = storeValidIndexes(pNr), cardNr = -1, bestScore;
   bool shootTheMoon = (P[pNr].points - P[pNr].startPoints) >= P[pNr].threshold;
   for(int i = 0; i < 4; i++){
@@ -294,7 +1007,7 @@ int Hearts::playRBCard(int pNr){
     }
     if((!shootTheMoon && score > bestScore)
       || (shootTheMoon && score < bestScore)
-      || (score == bestScore && rand()%2 == 0)){
+      || (score == bestScore && randomInt()%2 == 0)){
       bestScore = score;
       cardNr = i;
     }
@@ -304,7 +1017,8 @@ int Hearts::playRBCard(int pNr){
 
 
 // Plays out the rest of the game randomly, starting from player pNr
-void Hearts::randomPlayout(int pNr){
+template<class Rules>
+void Hearts<Rules>::randomPlayout(int pNr){
   int _trickNr = trickNr;
   debug = false;
   for(int i = 0; i < 4; i++){
@@ -327,23 +1041,26 @@ void Hearts::randomPlayout(int pNr){
 
 // Gets which player can own what suit based on available information
 // The player the search is queried for is exempted from it
-void Hearts::setSuitOwners(int pNr){
-  memset(ownerOfSuit, -1, sizeof(ownerOfSuit));
+// Only done for a player that is about to decide
+template<class Rules>
+void Hearts<Rules>::setSuitOwners(int pNr){
+  Knowledge &K = P[pNr].info;
+  memset(K.owner, -1, sizeof(K.owner));
   for(int i = 0; i < 4; i++){
     int owner = 0, singleSuit = -1, pCount = 0, sCount = 4;
     for(int j = 0; j < 4; j++){
       if(i != pNr){
-        P[i].noneOfSuit[j] ? sCount-- : singleSuit = j;
+        voids[i] & (1 << j) ? sCount-- : singleSuit = j;
       }
       if(j != pNr){
-        P[j].noneOfSuit[i] ? pCount++ : owner = j;
+        voids[j] & (1 << i) ? pCount++ : owner = j;
       }
     }
-    if(ownerOfSuit[i] == -1 && pCount == 2){
-      ownerOfSuit[i] = owner;
+    if(K.owner[i] == -1 && pCount == 2){
+      K.owner[i] = owner;
     }
-    if(ownerOfSuit[singleSuit] == -1 && sCount == 1){
-      ownerOfSuit[singleSuit] = i;
+    if(sCount == 1 && K.owner[singleSuit] == -1){
+      K.owner[singleSuit] = i;
     }
   }
 }
@@ -352,7 +1069,8 @@ void Hearts::setSuitOwners(int pNr){
 // current player such that all current knowledge is used, but there is no need
 // to access hidden information.
 // TODO: Predictive determinization, cleanup
-void Hearts::determinize(int pNr){
+template<class Rules>
+void Hearts<Rules>::determinize(int pNr){
   /*
     // Random version
     for(int k = 0; k < 100000; k++){
@@ -383,7 +1101,7 @@ void Hearts::determinize(int pNr){
       for(int i = 0; i < 4; i++){
         if(i != pNr){
           for(int j = 0; j < 13;  j++){
-            if(P[i].hand[j] != -1 && P[i].noneOfSuit[P[i].hand[j]/13]){
+            if(P[i].hand[j] != -1 && voids[i] & (1 << P[i].hand[j]/13)){
               error = true;
               break;
             }
@@ -396,35 +1114,33 @@ void Hearts::determinize(int pNr){
       break;
     }
   */
+  Knowledge &K = P[pNr].info;
   int size = 0, amtOfSpots[4] = {0}, amtOfSuit[4] = {0}, unknown[39], spot[39];
-  for(int i = 0; i < 4; i++){
-    if(i != pNr){
-      for(int j = 0; j < 13; j++){
-        int card = P[i].hand[j];
-        if(card != -1 && !P[pNr].known[card] && ownerOfSuit[card/13] != i){
-          unknown[size] = P[i].hand[j];
-          spot[size] = i*100+j;
-          amtOfSuit[card/13]++;
-          amtOfSpots[i]++;
-          size++;
-        }
-      }
+  for(unsigned long long mask = K.unseen; mask != 0; mask &= mask-1){
+    int card = __builtin_ctzll(mask), owner = location[card]/13;
+    if(K.owner[card/13] != owner){
+      unknown[size] = card;
+      spot[size] = location[card];
+      P[owner].cards &= ~(1ULL << card);
+      amtOfSuit[card/13]++;
+      amtOfSpots[owner]++;
+      size++;
     }
   }
   for(int i = 0; i < 4; i++){
     if(i != pNr && amtOfSpots[i] > 0){
       int invalids = 0;
       for(int j = 0; j < 4; j++){
-        if(P[i].noneOfSuit[j]){
+        if(voids[i] & (1 << j)){
           invalids += amtOfSuit[j];
         }
       }
       if(size - invalids == amtOfSpots[i]){
         for(int j = size-1; j >= 0; j--){
-          if(!P[i].noneOfSuit[unknown[j]/13]){
+          if(!(voids[i] & (1 << unknown[j]/13))){
             for(int k = 0; k < size; k++){
-              if(spot[k]/100 == i){
-                P[i].hand[spot[k]%100] = unknown[j];
+              if(spot[k]/13 == i){
+                placeCard(i, spot[k]%13, unknown[j]);
                 unknown[j] = unknown[size-1];
                 spot[k] = spot[size-1];
                 size--;
@@ -442,19 +1158,22 @@ void Hearts::determinize(int pNr){
     int currSize = size;
     for(int j = 0; j < size; j++){
       currUnknown[j] = unknown[j];
+      for(int k = 0; k < 4; k++){
+        P[k].cards &= ~(1ULL << unknown[j]);
+      }
     }
     shuffle(currUnknown, size);
     shuffle(spot, size);
     while(currSize > 0){
-      int receiver = spot[currSize-1]/100, toDeal = currSize-1;
-      while(P[receiver].noneOfSuit[currUnknown[toDeal]/13]){
+      int receiver = spot[currSize-1]/13, toDeal = currSize-1;
+      while(voids[receiver] & (1 << currUnknown[toDeal]/13)){
         if(toDeal == 0){
           error = true;
           break;
         }
         toDeal--;
       }
-      P[receiver].hand[spot[currSize-1]%100] = currUnknown[toDeal];
+      placeCard(receiver, spot[currSize-1]%13, currUnknown[toDeal]);
       currUnknown[toDeal] = currUnknown[currSize-1];
       currSize--;
     }
@@ -464,10 +1183,185 @@ void Hearts::determinize(int pNr){
   }
 }
 
+// Returns the amount of points a card is worth under the rules
+template<class Rules>
+int Hearts<Rules>::cardPoints(int card){
+  if(card/13 == 2){
+    return Rules::heartPoints;
+  }
+  if(card == 49){
+    return Rules::queenPoints;
+  }
+  return card == 22 ? Rules::jackPoints : 0;
+}
+
+// Checks whether two cards are strategically identical for a player: they
+// are of the same suit and worth the same points, and every card ranked in
+// between them has either been played in an earlier trick or is in the hand
+// of the player itself
+template<class Rules>
+bool Hearts<Rules>::equivalentCards(int pNr, int card1, int card2){
+  bool inHand[52] = {false};
+  if(card1/13 != card2/13 || cardPoints(card1) != cardPoints(card2)){
+    return false;
+  }
+  for(int i = 0; i < 13; i++){
+    if(P[pNr].hand[i] != -1){
+      inHand[P[pNr].hand[i]] = true;
+    }
+  }
+  for(int card = std::min(card1, card2)+1; card < std::max(card1, card2); card++){
+    if(!cardsPlayed[card] && !inHand[card]){
+      return false;
+    }
+  }
+  return true;
+}
+
+// Brings the pool of worlds of a player up to date with what the player
+// has seen since the previous decision: worlds that no longer fit are
+// repaired or dropped, after which fresh ones are sampled until there is
+// one per playout
+template<class Rules>
+void Hearts<Rules>::refreshPool(int pNr){
+  Pool &pool = pools[pNr];
+  int amtKept = 0, target = P[pNr].playouts;
+  if((int)pool.worlds.size() < target){
+    pool.worlds.resize(target);
+  }
+  for(int i = 0; i < pool.amtOfWorlds; i++){
+    if(repairWorld(pNr, pool.worlds[i])){
+      pool.worlds[amtKept] = pool.worlds[i];
+      amtKept++;
+    }
+  }
+  for(pool.amtOfWorlds = amtKept; pool.amtOfWorlds < target; pool.amtOfWorlds++){
+    Hearts T = *this;
+    T.determinize(pNr);
+    for(int i = 0; i < 4; i++){
+      pool.worlds[pool.amtOfWorlds].cards[i] = i == pNr ? 0 : T.P[i].cards & P[pNr].info.unseen;
+    }
+  }
+}
+
+// Fits a world to the current knowledge of a player: cards that have been
+// seen since are removed, and cards a player is now known not to be able
+// to hold or holds too many of are handed to players that are short of
+// cards, chosen at random as far as their voids allow
+// Returns false if the world cannot be repaired
+template<class Rules>
+bool Hearts<Rules>::repairWorld(int pNr, World &world){
+  Knowledge &K = P[pNr].info;
+  unsigned long long loose = 0;
+  int needed[4];
+  for(int i = 0; i < 4; i++){
+    unsigned long long invalid = 0;
+    if(i == pNr){
+      continue;
+    }
+    needed[i] = held[i] - __builtin_popcountll(P[i].cards & ~K.unseen);
+    for(int j = 0; j < 4; j++){
+      if(voids[i] & (1 << j)){
+        invalid |= 0x1FFFULL << 13*j;
+      }
+    }
+    world.cards[i] &= K.unseen;
+    loose |= world.cards[i] & invalid;
+    world.cards[i] &= ~invalid;
+    while(__builtin_popcountll(world.cards[i]) > needed[i]){
+      unsigned long long mask = world.cards[i];
+      for(int j = randomInt() % __builtin_popcountll(mask); j > 0; j--){
+        mask &= mask-1;
+      }
+      loose |= mask & -mask;
+      world.cards[i] &= ~(mask & -mask);
+    }
+  }
+  for(; loose != 0; loose &= loose-1){
+    int card = __builtin_ctzll(loose), receivers[3], amtOfReceivers = 0;
+    for(int i = 0; i < 4; i++){
+      if(i != pNr && __builtin_popcountll(world.cards[i]) < needed[i]
+        && !(voids[i] & (1 << card/13))){
+        receivers[amtOfReceivers] = i;
+        amtOfReceivers++;
+      }
+    }
+    if(amtOfReceivers == 0){
+      return false;
+    }
+    world.cards[receivers[randomInt() % amtOfReceivers]] |= 1ULL << card;
+  }
+  for(int i = 0; i < 4; i++){
+    if(i != pNr && __builtin_popcountll(world.cards[i]) != needed[i]){
+      return false;
+    }
+  }
+  return true;
+}
+
+// Deals the unseen cards of a player according to a world
+template<class Rules>
+void Hearts<Rules>::applyWorld(int pNr, const World &world){
+  unsigned long long unseen = P[pNr].info.unseen;
+  for(int i = 0; i < 4; i++){
+    unsigned long long toDeal = world.cards[i];
+    if(i == pNr){
+      continue;
+    }
+    P[i].cards &= ~unseen;
+    for(int j = 0; j < 13; j++){
+      int card = P[i].hand[j];
+      if(card != -1 && (unseen & (1ULL << card))){
+        placeCard(i, j, __builtin_ctzll(toDeal));
+        toDeal &= toDeal-1;
+      }
+    }
+  }
+}
+
+// Exports a decision of a MC player, with the scores of all candidates
+// Clairvoyant players are not traced, as their scores use hidden cards
+template<class Rules>
+void Hearts<Rules>::traceDecision(int pNr, int amtValid, const int *scores, int bestCardNr){
+  TraceRecord record;
+  memset(&record, 0, sizeof(record));
+  memset(record.table, -1, sizeof(record.table));
+  memset(record.candidates, -1, sizeof(record.candidates));
+  record.hand = P[pNr].cards;
+  record.unseen = P[pNr].info.unseen;
+  for(int i = 0; i < 52; i++){
+    if(cardsPlayed[i]){
+      record.played |= 1ULL << i;
+    }
+  }
+  for(int i = 0; i < 4; i++){
+    record.points[i] = P[i].points - P[i].startPoints;
+    record.gamePoints[i] = P[i].points;
+    record.voids |= voids[i] << 4*i;
+  }
+  for(int i = first; i%4 != pNr; i++){
+    record.table[i-first] = P[i%4].played;
+  }
+  for(int i = 0; i < amtValid; i++){
+    record.candidates[i] = P[pNr].hand[P[pNr].validIndexes[i]];
+    record.scores[i] = scores[i];
+    if(P[pNr].validIndexes[i] == bestCardNr){
+      record.chosen = i;
+    }
+  }
+  record.playouts = P[pNr].playouts;
+  record.player = pNr;
+  record.first = first;
+  record.trickNr = trickNr;
+  record.amtValid = amtValid;
+  trace->write(record);
+}
+
 // Compares the current situation for the player relative to another one
 // and assigns points to it
 // TODO: Avoid really bad moves
-int Hearts::compareSituation(int pNr, Hearts O){
+template<class Rules>
+int Hearts<Rules>::compareSituation(int pNr, Hearts O){
   return P[pNr].points - O.P[pNr].points;
 }
 
@@ -477,37 +1371,89 @@ int Hearts::compareSituation(int pNr, Hearts O){
 //       Also, do borderline shoot-the-moon cases get stuck between
 //       two options and choose a bad path? Maybe count cases and choose
 //       most occurring one
-int Hearts::playMCCard(int pNr){
-  int amtValid = storeValidIndexes(pNr), bestCardNr = -1;
-  int lowestScore = 100*P[pNr].playouts, score;
-  setSuitOwners(pNr);
+// Only one card of every class of equivalent cards is searched, the others
+// share its score
+// Forced cards are played directly, and in the first tricks the decision
+// is taken from the book if it is there
+// If pools are set, the playouts use the worlds of the pool of the player
+// instead of a new determinization each
+template<class Rules>
+int Hearts<Rules>::playMCCard(int pNr){
+  int amtValid = storeValidIndexes(pNr), bestCardNr = -1, bookCard;
+  int lowestScore = 100*P[pNr].playouts, score, scores[13], classOf[13];
+  if(amtValid == 1){
+    return playCard(pNr, P[pNr].validIndexes[0]);
+  }
+  if(lookupBook(pNr, false, &bookCard)){
+    for(int i = 0; i < amtValid; i++){
+      if(P[pNr].validIndexes[i] == location[bookCard]%13){
+        return playCard(pNr, P[pNr].validIndexes[i]);
+      }
+    }
+  }
+  if(P[pNr].type == PT_MC){
+    setSuitOwners(pNr);
+  }
+  if(pools != NULL && P[pNr].type == PT_MC){
+    refreshPool(pNr);
+  }
   for(int i = 0; i < amtValid; i++){
-    Hearts C = *this;
-    int cardNr = C.P[pNr].validIndexes[i];
-    score = 0;
-    C.P[pNr].played = C.playCard(pNr, cardNr);
-    for(int j = 0; j < P[pNr].playouts; j++){
-      Hearts T = C;
-      if(P[pNr].type == PT_MC){
-        T.determinize(pNr);
+    classOf[i] = i;
+    for(int j = 0; j < i; j++){
+      if(classOf[j] == j && equivalentCards(pNr, P[pNr].hand[P[pNr].validIndexes[i]],
+        P[pNr].hand[P[pNr].validIndexes[j]])){
+        classOf[i] = j;
+        break;
+      }
+    }
+  }
+  for(int i = 0; i < amtValid; i++){
+    int cardNr = P[pNr].validIndexes[i];
+    if(classOf[i] != i){
+      score = scores[classOf[i]];
+    }
+    else{
+      Hearts C = *this;
+      score = 0;
+      C.P[pNr].played = C.playCard(pNr, cardNr);
+      for(int j = 0; j < P[pNr].playouts; j++){
+        Hearts T = C;
+        if(P[pNr].type == PT_MC && pools != NULL){
+          T.applyWorld(pNr, pools[pNr].worlds[j]);
+        }
+        else if(P[pNr].type == PT_MC){
+          T.determinize(pNr);
+        }
+        T.randomPlayout((pNr+1)%4);
+        score += T.compareSituation(pNr, C);
       }
-      T.randomPlayout((pNr+1)%4);
-      score += T.compareSituation(pNr, C);
+      /*if(score - lowestScore < P[pNr].playouts){
+        // Per playout 1 point, check bounds
+      }*/
     }
-    /*if(score - lowestScore < P[pNr].playouts){
-      // Per playout 1 point, check bounds
-    }*/
-    if(score < lowestScore || (score == lowestScore && rand()%2 == 0)){
+    scores[i] = score;
+    if(score < lowestScore || (score == lowestScore && randomInt()%2 == 0)){
       bestCardNr = cardNr;
       lowestScore = score;
     }
   }
+  if(P[pNr].type == PT_MC && recorded != NULL){
+    int cards[13];
+    for(int i = 0; i < amtValid; i++){
+      cards[i] = P[pNr].hand[P[pNr].validIndexes[i]];
+    }
+    recordBook(pNr, false, cards, scores, amtValid);
+  }
+  if(trace != NULL && P[pNr].type == PT_MC){
+    traceDecision(pNr, amtValid, scores, bestCardNr);
+  }
   return playCard(pNr, bestCardNr);
 }
 
 // Updates the ranks of all the players
-void Hearts::updateStandings(){
-  int lowest = -1;
+template<class Rules>
+void Hearts<Rules>::updateStandings(){
+  int lowest = -1000;
   for(int i = 0; i < 4; i++){
     P[i].place = 0;
   }
@@ -526,39 +1472,56 @@ void Hearts::updateStandings(){
 }
 
 // Evaluates a trick by calculating the points and which player is next
-// TODO: Different points to test Shooting the Moon
-void Hearts::evaluateTrick(){
-  int highest = 0, next = -1, trickValue = 0;
+// A player shoots the moon by taking all hearts and the queen of spades,
+// which is scored in the trick in which the last of them is taken
+template<class Rules>
+void Hearts<Rules>::evaluateTrick(){
+  int highest = 0, next = -1, trickValue = 0, penaltyValue = 0, amtOfPenalties = 0;
+  const int moonPoints = 13*Rules::heartPoints + Rules::queenPoints;
   for(int i = 0; i < 4; i++){
+    cardsPlayed[P[i].played] = true;
+    playedBy[i] |= 1ULL << P[i].played;
     if(P[i].played/13 == trump && P[i].played > highest){
       highest = P[i].played;
       next = i;
     }
-    if(P[i].played/13 == 2){
-      trickValue++;
+    if(P[i].played/13 == 2 || P[i].played == 49){
+      penaltyValue += cardPoints(P[i].played);
+      amtOfPenalties++;
     }
-    else if(P[i].played == 49){
-      trickValue += 13;
+    else if(Rules::jackPoints != 0 && P[i].played == 22){
+      trickValue += Rules::jackPoints;
     }
   }
-  P[next].points += trickValue;
-  if(P[next].points - P[next].startPoints == 26){
-    P[next].points -= 26;
-    for(int i = next+1; i < next+4; i++){
-      P[i%4].points += 26;
-      if(P[i%4].points >= 100 && !gameWon){
-        gameWon = true;
+  if(!Rules::firstTrickScores && trickNr == 0){
+    trickValue = penaltyValue = 0;
+  }
+  P[next].points += trickValue + penaltyValue;
+  P[next].penalties += penaltyValue;
+  P[next].taken += amtOfPenalties;
+  if(amtOfPenalties > 0 && P[next].taken == 14){
+    P[next].points -= P[next].penalties;
+    if(Rules::moonSubtracts){
+      P[next].points -= moonPoints;
+    }
+    else{
+      for(int i = next+1; i < next+4; i++){
+        P[i%4].points += moonPoints;
+        if(P[i%4].points >= Rules::endPoints && !gameWon){
+          gameWon = true;
+        }
       }
     }
   }
-  else if(P[next].points >= 100 && !gameWon){
+  if(P[next].points >= Rules::endPoints && !gameWon){
     gameWon = true;
   }
   first = next;
 }
 
 // Plays a trick of Hearts
-void Hearts::playTrick(){
+template<class Rules>
+void Hearts<Rules>::playTrick(){
   if(debug) std::cout << "Player " << first << " is first." << std::endl;
   if(debug) std::cout << "Cards on table: ";
   for(int i = 0; i < 4; i++){
@@ -591,7 +1554,8 @@ void Hearts::playTrick(){
 
 // Writes statistics about the games to a file
 // TODO: Include file in class?
-void Hearts::writeStats(std::ofstream &out){
+template<class Rules>
+void Hearts<Rules>::writeStats(std::ofstream &out){
   for(int i = 0; i < 4; i++){
     out << "p" << i << "_" << P[i].place << '\n';
   }
@@ -599,23 +1563,34 @@ void Hearts::writeStats(std::ofstream &out){
 }
 
 // Plays a round of Hearts
-void Hearts::playRound(){
+template<class Rules>
+void Hearts<Rules>::playRound(){
   heartsBroken = false;
   roundNr++;
-  for(int i = 0; i < 4; i++){
-    memset(P[i].noneOfSuit, false, sizeof(P[i].noneOfSuit));
-    memset(P[i].known, false, sizeof(P[i].known));
-    P[i].startPoints = P[i].points;
+  memset(cardsPlayed, false, sizeof(cardsPlayed));
+  memset(playedBy, 0, sizeof(playedBy));
+  for(int i = 0; pools != NULL && i < 4; i++){
+    pools[i].amtOfWorlds = 0;
   }
-  shuffle(deck, 52);
+  dealCards();
   for(int i = 0; i < 4; i++){
+    P[i].cards = 0;
     for(int j = 0; j < 13; j++){
-      P[i].hand[j] = deck[i*13+j];
+      placeCard(i, j, deck[i*13+j]);
       if(P[i].hand[j] == 0){
         first = i;
       }
     }
   }
+  for(int i = 0; i < 4; i++){
+    P[i].info.unseen = ((1ULL << 52) - 1) & ~P[i].cards;
+    memset(P[i].info.owner, -1, sizeof(P[i].info.owner));
+    voids[i] = 0;
+    held[i] = 13;
+    P[i].startPoints = P[i].points;
+    P[i].penalties = 0;
+    P[i].taken = 0;
+  }
   passCards();
   if(debug) std::cout << std::endl;
   for(trickNr = 0; trickNr < 13; trickNr++){
@@ -637,7 +1612,8 @@ void Hearts::playRound(){
 }
 
 // Plays a game of Hearts
-void Hearts::playGame(){
+template<class Rules>
+void Hearts<Rules>::playGame(){
   for(int i = 0; i < 4; i++){
     P[i].points = 0;
   }
@@ -651,15 +1627,15 @@ void Hearts::playGame(){
   }
 }
 
-void Hearts::caseTest(){
-  memset(P[0].known, 0, sizeof(P[0].known));
-  memset(ownerOfSuit, 0, sizeof(ownerOfSuit));
+template<class Rules>
+void Hearts<Rules>::caseTest(){
+  memset(voids, 0, sizeof(voids));
+  memset(P[0].info.owner, -1, sizeof(P[0].info.owner));
   for(int i = 1; i < 4; i++){
     memset(P[i].hand, -1, sizeof(P[i].hand));
   }
-  P[2].noneOfSuit[0] = true;
-  P[3].noneOfSuit[1] = true;
-  P[3].noneOfSuit[3] = true;
+  voids[2] = 1 << 0;
+  voids[3] = 1 << 1 | 1 << 3;
   // std::ofstream o("det.txt");
   // std::string comp;
   long long int dists[2352];
@@ -668,25 +1644,32 @@ void Hearts::caseTest(){
   memset(distcts, 0, sizeof(distcts));
   int arr[16] = {0, 1, 13, 14, 15, 16, 17, 26, 27, 28, 29, 39, 40, 41, 42, 43};
   int sp[16] = {10, 11, 12, 13, 14, 15, 20, 21, 22, 23, 24, 30, 31, 32, 33, 34};
+  P[0].info.unseen = 0;
+  for(int i = 0; i < 16; i++){
+    P[0].info.unseen |= 1ULL << arr[i];
+  }
   for(int i = 0; i < 23520000; i++){
     long long int currdist = 0;
     // std::string str = "_suits ";
-    P[1].hand[0] = arr[0];
-    P[1].hand[1] = arr[1];
-    P[1].hand[2] = arr[2];
-    P[1].hand[3] = arr[3];
-    P[1].hand[4] = arr[4];
-    P[1].hand[5] = arr[5];
-    P[2].hand[0] = arr[6];
-    P[2].hand[1] = arr[7];
-    P[2].hand[2] = arr[8];
-    P[2].hand[3] = arr[9];
-    P[2].hand[4] = arr[10];
-    P[3].hand[0] = arr[11];
-    P[3].hand[1] = arr[12];
-    P[3].hand[2] = arr[13];
-    P[3].hand[3] = arr[14];
-    P[3].hand[4] = arr[15];
+    for(int j = 1; j < 4; j++){
+      P[j].cards = 0;
+    }
+    placeCard(1, 0, arr[0]);
+    placeCard(1, 1, arr[1]);
+    placeCard(1, 2, arr[2]);
+    placeCard(1, 3, arr[3]);
+    placeCard(1, 4, arr[4]);
+    placeCard(1, 5, arr[5]);
+    placeCard(2, 0, arr[6]);
+    placeCard(2, 1, arr[7]);
+    placeCard(2, 2, arr[8]);
+    placeCard(2, 3, arr[9]);
+    placeCard(2, 4, arr[10]);
+    placeCard(3, 0, arr[11]);
+    placeCard(3, 1, arr[12]);
+    placeCard(3, 2, arr[13]);
+    placeCard(3, 3, arr[14]);
+    placeCard(3, 4, arr[15]);
     determinize(0);
     // comp += "_dist";
     for(int j = 0; j < 16; j++){
@@ -751,14 +1734,64 @@ void Hearts::caseTest(){
   std::cout << std::endl;
 }
 
-int main(int argc, char *argv[]){
-  srand(time(NULL));
+// Explicit instantiations of the engine for every rule variant
+template class Hearts<StandardRules>;
+template class Hearts<OmnibusRules>;
+template class Hearts<OldMoonRules>;
+template class Hearts<FreeFirstTrickRules>;
+
+// Plays games on several threads, each with its own copy of the engine,
+// and exports every decision of the MC players to a trace file
+// With a deal file every thread starts at a different part of it
+template<class Rules>
+bool exportTraces(Hearts<Rules> *H, const char *fileName, int amtOfGames, int amtOfThreads){
+  std::atomic<int> gameNr(0);
+  std::vector<std::thread> threads;
+  TraceWriter *trace = new TraceWriter(fileName);
+  bool success = trace->good();
+  for(int i = 0; success && i < amtOfThreads; i++){
+    unsigned long long seed = randomInt();
+    threads.push_back(std::thread([=, &gameNr]{
+      Hearts<Rules> G = *H;
+      std::vector<typename Hearts<Rules>::Pool> pools(4);
+      seedRandom(seed);
+      G.setPools(pools.data());
+      G.setTrace(trace);
+      G.setDeal(i*(G.getAmtOfDeals()/amtOfThreads), 0);
+      while(gameNr++ < amtOfGames){
+        G.playGame();
+      }
+    }));
+  }
+  for(size_t i = 0; i < threads.size(); i++){
+    threads[i].join();
+  }
+  success = trace->close() && success;
+  if(success){
+    std::cout << "Wrote " << trace->getAmount() << " decisions to " << fileName << std::endl;
+  }
+  else{
+    std::cout << "Could not write the decisions to " << fileName << std::endl;
+  }
+  delete trace;
+  return success;
+}
+
+// Runs the program with the engine for a specific rule variant
+template<class Rules>
+int run(int argc, char *argv[]){
   clock_t start = clock();
   std::ofstream out;
   out.open("stats.txt");
-  Hearts *H = new Hearts();
+  Hearts<Rules> *H = new Hearts<Rules>();
+  std::vector<typename Hearts<Rules>::Pool> pools(4);
   int amtOfGames = 100;
   int progress = 0;
+  long dealBase = 0, dealEnd = 0;
+  bool duplicate = false;
+  const char *traceFile = NULL;
+  int amtOfThreads = 1;
+  H->setPools(pools.data());
   for(int i = 1; i < argc; i++){
     if(strcmp(argv[i], "-mc") == 0 && i+2 < argc){
       H->setPT(atoi(argv[++i]), H->PT_MC);
@@ -784,14 +1817,66 @@ int main(int argc, char *argv[]){
       H->debugMode();
       progress = -1;
     }
+    else if(strcmp(argv[i], "-gd") == 0 && i+3 < argc){
+      bool success = H->generateDeals(argv[i+1], atoi(argv[i+2]), atoi(argv[i+3]));
+      delete H;
+      return success ? 0 : 1;
+    }
+    else if(strcmp(argv[i], "-bb") == 0 && i+3 < argc){
+      bool success = H->buildBook(argv[i+1], atoi(argv[i+2]), atoi(argv[i+3]));
+      H->closeFiles();
+      delete H;
+      return success ? 0 : 1;
+    }
+    else if(strcmp(argv[i], "-bk") == 0 && i+1 < argc){
+      if(!H->loadBook(argv[++i])){
+        H->closeFiles();
+        delete H;
+        return 1;
+      }
+    }
+    else if(strcmp(argv[i], "-dd") == 0 && i+1 < argc){
+      if(!H->loadDeals(argv[++i])){
+        H->closeFiles();
+        delete H;
+        return 1;
+      }
+      duplicate = true;
+    }
+    else if(strcmp(argv[i], "-r") == 0 && i+1 < argc){
+      i++;
+    }
+    else if(strcmp(argv[i], "-x") == 0 && i+2 < argc){
+      traceFile = argv[++i];
+      amtOfThreads = std::max(1, atoi(argv[++i]));
+    }
     else if(argv[i] != NULL){
       amtOfGames = atoi(argv[i]);
     }
   }
   // H->caseTest();
+  if(duplicate && amtOfGames%4 != 0){
+    std::cout << "Warning: " << amtOfGames << " games is not a multiple of 4, ";
+    std::cout << "so the last deals are not played in every rotation" << std::endl;
+  }
+  if(traceFile != NULL){
+    bool success = exportTraces(H, traceFile, amtOfGames, amtOfThreads);
+    H->closeFiles();
+    delete H;
+    return success ? 0 : 1;
+  }
   if(progress == 0) std::cout << "Progress: " << std::endl;
   for(int i = 0; i < amtOfGames; i++){
+    // In duplicate mode every group of four games replays the same deals,
+    // each time with the hands rotated by one more seat
+    if(duplicate){
+      if(i%4 == 0){
+        dealBase = dealEnd;
+      }
+      H->setDeal(dealBase, i%4);
+    }
     H->playGame();
+    dealEnd = std::max(dealEnd, H->getDealNr());
     H->writeStats(out);
     if(progress >= 0){
       if(i >= progress*(float)amtOfGames/100.0){
@@ -806,7 +1891,33 @@ int main(int argc, char *argv[]){
   for(int i = 0; i < 4; i++){
     std::cout << "Player " << i << ": " << H->getTotalPoints(i) / (float)amtOfGames << std::endl;
   }
+  H->closeFiles();
   delete H;
   std::cout << "Time required: " << (clock() - start) / (double) CLOCKS_PER_SEC << "s" << std::endl;
   return 0;
 }
+
+// Picks the rule variant given by -r, standard if there is none
+int main(int argc, char *argv[]){
+  const char *rules = "standard";
+  seedRandom(time(NULL));
+  for(int i = 1; i+1 < argc; i++){
+    if(strcmp(argv[i], "-r") == 0){
+      rules = argv[i+1];
+    }
+  }
+  if(strcmp(rules, "standard") == 0){
+    return run<StandardRules>(argc, argv);
+  }
+  else if(strcmp(rules, "omnibus") == 0){
+    return run<OmnibusRules>(argc, argv);
+  }
+  else if(strcmp(rules, "oldmoon") == 0){
+    return run<OldMoonRules>(argc, argv);
+  }
+  else if(strcmp(rules, "freefirst") == 0){
+    return run<FreeFirstTrickRules>(argc, argv);
+  }
+  std::cout << "Unknown rules " << rules << ", expected standard, omnibus, oldmoon or freefirst" << std::endl;
+  return 1;
+}